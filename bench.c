@@ -0,0 +1,1056 @@
+/*
+ * Copyright (C) 2023 Ronsor Labs. All rights reserved.
+ * This software is free software provided to you under the terms of the MIT
+ * license. For more information, see the included `LICENSE` file.
+ *
+ * VecDex: benchmark harness.
+ */
+
+#include <math.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "vecdex.h"
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#endif
+
+#define BENCH_BUSY_TIMEOUT 5000
+#define BENCH_WRITE_BATCH 64
+#define BENCH_MAX_DIMS 16
+
+/* Scale from median absolute deviation to a normal standard deviation. */
+#define BENCH_MAD_SIGMA 1.4826
+
+/* Separate invocations a baseline needs per result to estimate noise. */
+#define BENCH_MIN_BASELINE_RUNS 3
+
+typedef struct BenchOptions {
+  const char* zDbPath;
+  const char* zDataset;
+  int nRows;
+  int dim;
+  int dims[BENCH_MAX_DIMS];
+  int nDims;
+  int k;
+  int nReaders;
+  double writeRate;
+  double seconds;
+  double interval;
+  int useCounters;
+  int runs;
+  const char* zJsonPath;
+  const char* zBaselinePath;
+  double threshold;
+} BenchOptions;
+
+/*
+ * One measured result, keyed by name, dimension and dataset.
+ */
+typedef struct BenchResult {
+  char zName[64];
+  char zDataset[32];
+  int dim;
+  int runs;
+  double median;
+  double mad;
+} BenchResult;
+
+static BenchResult* benchResults = NULL;
+static int benchResultCount = 0;
+
+static double benchNow(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * Small per-thread PRNG (xorshift64*); rand() is not thread-safe.
+ */
+static uint64_t benchRand(uint64_t* state) {
+  uint64_t x = *state;
+  x ^= x >> 12;
+  x ^= x << 25;
+  x ^= x >> 27;
+  *state = x;
+  return x * 0x2545F4914F6CDD1DULL;
+}
+
+static void benchRandVector(uint64_t* state, float* vec, int dim) {
+  for (int i = 0; i < dim; i++) {
+    vec[i] = (float)(benchRand(state) >> 40) / (float)(1 << 24) * 2.0f - 1.0f;
+  }
+}
+
+/*
+ * Fill a vector from the named dataset distribution.
+ */
+static void benchDatasetVector(const char* zDataset, uint64_t* state,
+                               float* vec, int dim) {
+  if (strcmp(zDataset, "gaussian") == 0) {
+    for (int i = 0; i < dim; i += 2) {
+      double u1 = ((benchRand(state) >> 11) + 1.0) / 9007199254740993.0;
+      double u2 = (benchRand(state) >> 11) / 9007199254740992.0;
+      double r = sqrt(-2.0 * log(u1));
+      vec[i] = (float)(r * cos(2.0 * M_PI * u2));
+      if (i + 1 < dim) vec[i + 1] = (float)(r * sin(2.0 * M_PI * u2));
+    }
+    return;
+  }
+  benchRandVector(state, vec, dim);
+}
+
+static int benchCompareDouble(const void* a, const void* b) {
+  double x = *(const double*)a, y = *(const double*)b;
+  return (x > y) - (x < y);
+}
+
+/*
+ * Get the median of an array, sorting it in place.
+ */
+static double benchMedian(double* values, int n) {
+  if (n == 0) return 0.0;
+  qsort(values, n, sizeof(double), benchCompareDouble);
+  return n % 2 ? values[n / 2] : (values[n / 2 - 1] + values[n / 2]) / 2.0;
+}
+
+/*
+ * Record repeated measurements of one result as median and median
+ * absolute deviation, which stay meaningful with a few noisy outliers.
+ */
+static BenchResult* benchRecord(const char* zName, const char* zDataset,
+                                int dim, const double* samples, int n) {
+  benchResults = realloc(benchResults,
+                         (benchResultCount + 1) * sizeof(BenchResult));
+  BenchResult* res = &benchResults[benchResultCount++];
+  memset(res, 0, sizeof(*res));
+  snprintf(res->zName, sizeof(res->zName), "%s", zName);
+  snprintf(res->zDataset, sizeof(res->zDataset), "%s", zDataset);
+  res->dim = dim;
+  res->runs = n;
+
+  double* work = malloc((n + 1) * sizeof(double));
+  memcpy(work, samples, n * sizeof(double));
+  res->median = benchMedian(work, n);
+  for (int i = 0; i < n; i++) {
+    work[i] = fabs(samples[i] - res->median);
+  }
+  res->mad = benchMedian(work, n);
+  free(work);
+  return res;
+}
+
+/*
+ * Get the p-th percentile (0..1) of a sorted array.
+ */
+static double benchPercentile(const double* sorted, int n, double p) {
+  if (n == 0) return 0.0;
+  int i = (int)ceil(p * n) - 1;
+  if (i < 0) i = 0;
+  if (i >= n) i = n - 1;
+  return sorted[i];
+}
+
+/*
+ * Open a connection with VecDex registered on it.
+ */
+static sqlite3* benchOpen(const char* zPath, int flags) {
+  sqlite3* db = NULL;
+  char* zErr = NULL;
+  if (sqlite3_open_v2(zPath, &db, flags | SQLITE_OPEN_NOMUTEX,
+                      NULL) != SQLITE_OK) {
+    fprintf(stderr, "open %s: %s\n", zPath, sqlite3_errmsg(db));
+    sqlite3_close(db);
+    return NULL;
+  }
+  if (sqlite3_vecdex_init(db, &zErr) != SQLITE_OK) {
+    fprintf(stderr, "vecdex init: %s\n", zErr);
+    sqlite3_free(zErr);
+    sqlite3_close(db);
+    return NULL;
+  }
+  sqlite3_busy_timeout(db, BENCH_BUSY_TIMEOUT);
+  return db;
+}
+
+static int benchExec(sqlite3* db, const char* zSql) {
+  char* zErr = NULL;
+  if (sqlite3_exec(db, zSql, NULL, NULL, &zErr) != SQLITE_OK) {
+    fprintf(stderr, "%s: %s\n", zSql, zErr);
+    sqlite3_free(zErr);
+    return 1;
+  }
+  return 0;
+}
+
+/*
+ * Create a fresh WAL database holding nRows random vectors.
+ */
+static sqlite3* benchCreateDb(const BenchOptions* opts) {
+  static const char* suffixes[] = { "", "-wal", "-shm" };
+  for (int i = 0; i < sizeof(suffixes) / sizeof(*suffixes); i++) {
+    char* zFile = sqlite3_mprintf("%s%s", opts->zDbPath, suffixes[i]);
+    unlink(zFile);
+    sqlite3_free(zFile);
+  }
+
+  sqlite3* db = benchOpen(opts->zDbPath,
+                          SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE);
+  if (!db) return NULL;
+
+  if (benchExec(db, "PRAGMA journal_mode=WAL;"
+                    "PRAGMA synchronous=NORMAL;"
+                    "CREATE TABLE vecs(id INTEGER PRIMARY KEY, v BLOB);"
+                    "BEGIN;")) {
+    sqlite3_close(db);
+    return NULL;
+  }
+
+  sqlite3_stmt* stmt;
+  sqlite3_prepare_v2(db, "INSERT INTO vecs(v) VALUES (?1)", -1, &stmt, NULL);
+  float* vec = malloc(opts->dim * sizeof(float));
+  uint64_t seed = 0x9E3779B97F4A7C15ULL;
+  for (int i = 0; i < opts->nRows; i++) {
+    benchDatasetVector(opts->zDataset, &seed, vec, opts->dim);
+    sqlite3_bind_blob(stmt, 1, vec, opts->dim * sizeof(float), SQLITE_STATIC);
+    sqlite3_step(stmt);
+    sqlite3_reset(stmt);
+  }
+  free(vec);
+  sqlite3_finalize(stmt);
+
+  if (benchExec(db, "COMMIT;")) {
+    sqlite3_close(db);
+    return NULL;
+  }
+  return db;
+}
+
+/*
+ * Hardware performance counters, read as one perf_event group so they all
+ * cover exactly the same region. Opening them fails without a PMU or with
+ * a restrictive perf_event_paranoid; callers then report no counters.
+ */
+enum {
+  BENCH_CTR_CYCLES,
+  BENCH_CTR_INSTRUCTIONS,
+  BENCH_CTR_CACHE_MISSES,
+  BENCH_CTR_BRANCH_MISSES,
+  BENCH_CTR_COUNT
+};
+
+typedef struct BenchCounters {
+  int fds[BENCH_CTR_COUNT];
+  int ok;
+} BenchCounters;
+
+static void benchCountersClose(BenchCounters* ctrs) {
+#ifdef __linux__
+  for (int i = 0; i < BENCH_CTR_COUNT; i++) {
+    if (ctrs->fds[i] >= 0) close(ctrs->fds[i]);
+    ctrs->fds[i] = -1;
+  }
+#endif
+  ctrs->ok = 0;
+}
+
+static int benchCountersOpen(BenchCounters* ctrs) {
+  for (int i = 0; i < BENCH_CTR_COUNT; i++) {
+    ctrs->fds[i] = -1;
+  }
+  ctrs->ok = 0;
+
+#ifdef __linux__
+  static const uint64_t configs[BENCH_CTR_COUNT] = {
+    PERF_COUNT_HW_CPU_CYCLES,
+    PERF_COUNT_HW_INSTRUCTIONS,
+    PERF_COUNT_HW_CACHE_MISSES,
+    PERF_COUNT_HW_BRANCH_MISSES,
+  };
+
+  for (int i = 0; i < BENCH_CTR_COUNT; i++) {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = configs[i];
+    attr.disabled = i == 0;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED |
+                       PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+    int fd = syscall(SYS_perf_event_open, &attr, 0, -1,
+                     i == 0 ? -1 : ctrs->fds[0], 0);
+    if (fd < 0) {
+      benchCountersClose(ctrs);
+      return 0;
+    }
+    ctrs->fds[i] = fd;
+  }
+  ctrs->ok = 1;
+#endif
+  return ctrs->ok;
+}
+
+static void benchCountersStart(BenchCounters* ctrs) {
+#ifdef __linux__
+  if (!ctrs->ok) return;
+  ioctl(ctrs->fds[0], PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+  ioctl(ctrs->fds[0], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+#endif
+}
+
+/*
+ * Stop counting and read the values. Returns 0 if counters are not
+ * available, or if the group was not on the PMU for the whole region
+ * (multiplexed with other events, such as the NMI watchdog, or never
+ * scheduled), since the counts would then be partial.
+ */
+static int benchCountersStop(BenchCounters* ctrs,
+                             uint64_t values[BENCH_CTR_COUNT]) {
+#ifdef __linux__
+  if (!ctrs->ok) return 0;
+  ioctl(ctrs->fds[0], PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+
+  /* nr, time_enabled, time_running, then one value per counter. */
+  uint64_t buf[3 + BENCH_CTR_COUNT];
+  if (read(ctrs->fds[0], buf, sizeof(buf)) != sizeof(buf) ||
+      buf[0] != BENCH_CTR_COUNT || buf[2] == 0 || buf[2] < buf[1]) {
+    return 0;
+  }
+  memcpy(values, buf + 3, BENCH_CTR_COUNT * sizeof(uint64_t));
+  return 1;
+#else
+  return 0;
+#endif
+}
+
+/*
+ * Latencies recorded by one reader since the last report.
+ */
+typedef struct BenchLatencies {
+  pthread_mutex_t lock;
+  double* samples;
+  int n;
+  int alloc;
+} BenchLatencies;
+
+static void benchLatenciesAdd(BenchLatencies* lat, double value) {
+  pthread_mutex_lock(&lat->lock);
+  if (lat->n == lat->alloc) {
+    lat->alloc = lat->alloc ? lat->alloc * 2 : 1024;
+    lat->samples = realloc(lat->samples, lat->alloc * sizeof(double));
+  }
+  lat->samples[lat->n++] = value;
+  pthread_mutex_unlock(&lat->lock);
+}
+
+typedef struct BenchConcurrentState {
+  const BenchOptions* opts;
+  atomic_int stop;
+  atomic_long nWrites;
+  atomic_long nErrors;
+  BenchLatencies* readerLat;
+} BenchConcurrentState;
+
+typedef struct BenchReaderArg {
+  BenchConcurrentState* state;
+  int id;
+} BenchReaderArg;
+
+static void* benchReaderThread(void* pArg) {
+  BenchReaderArg* arg = pArg;
+  BenchConcurrentState* state = arg->state;
+  const BenchOptions* opts = state->opts;
+  BenchLatencies* lat = &state->readerLat[arg->id];
+
+  sqlite3* db = benchOpen(opts->zDbPath, SQLITE_OPEN_READONLY);
+  if (!db) {
+    atomic_fetch_add(&state->nErrors, 1);
+    return NULL;
+  }
+
+  sqlite3_stmt* stmt;
+  sqlite3_prepare_v2(db, "SELECT id FROM vecs "
+                         "ORDER BY vector_dist(v, ?1) LIMIT ?2",
+                     -1, &stmt, NULL);
+  float* query = malloc(opts->dim * sizeof(float));
+  uint64_t seed = 0xD1B54A32D192ED03ULL * (arg->id + 1);
+
+  while (!atomic_load(&state->stop)) {
+    benchRandVector(&seed, query, opts->dim);
+    double start = benchNow();
+    sqlite3_bind_blob(stmt, 1, query, opts->dim * sizeof(float),
+                      SQLITE_STATIC);
+    sqlite3_bind_int(stmt, 2, opts->k);
+    int rc;
+    while ((rc = sqlite3_step(stmt)) == SQLITE_ROW);
+    sqlite3_reset(stmt);
+    if (rc != SQLITE_DONE) {
+      atomic_fetch_add(&state->nErrors, 1);
+      continue;
+    }
+    benchLatenciesAdd(lat, benchNow() - start);
+  }
+
+  free(query);
+  sqlite3_finalize(stmt);
+  sqlite3_close(db);
+  return NULL;
+}
+
+static void* benchWriterThread(void* pArg) {
+  BenchConcurrentState* state = pArg;
+  const BenchOptions* opts = state->opts;
+
+  sqlite3* db = benchOpen(opts->zDbPath, SQLITE_OPEN_READWRITE);
+  if (!db) {
+    atomic_fetch_add(&state->nErrors, 1);
+    return NULL;
+  }
+
+  /*
+   * Each write inserts a new vector and deletes the oldest one, so the
+   * table keeps its initial size and readers measure contention rather
+   * than a growing scan.
+   */
+  sqlite3_stmt *insertStmt, *deleteStmt;
+  sqlite3_prepare_v2(db, "INSERT INTO vecs(v) VALUES (?1)", -1,
+                     &insertStmt, NULL);
+  sqlite3_prepare_v2(db, "DELETE FROM vecs "
+                         "WHERE id = (SELECT min(id) FROM vecs)", -1,
+                     &deleteStmt, NULL);
+  float* vec = malloc(opts->dim * sizeof(float));
+  uint64_t seed = 0xA0761D6478BD642FULL;
+  double start = benchNow();
+
+  while (!atomic_load(&state->stop)) {
+    if (benchExec(db, "BEGIN IMMEDIATE;")) {
+      atomic_fetch_add(&state->nErrors, 1);
+      continue;
+    }
+
+    for (int i = 0; i < BENCH_WRITE_BATCH; i++) {
+      benchRandVector(&seed, vec, opts->dim);
+      sqlite3_bind_blob(insertStmt, 1, vec, opts->dim * sizeof(float),
+                        SQLITE_STATIC);
+      sqlite3_step(insertStmt);
+      sqlite3_reset(insertStmt);
+      sqlite3_step(deleteStmt);
+      sqlite3_reset(deleteStmt);
+    }
+
+    if (benchExec(db, "COMMIT;")) {
+      atomic_fetch_add(&state->nErrors, 1);
+      continue;
+    }
+    long writes = atomic_fetch_add(&state->nWrites, BENCH_WRITE_BATCH) +
+                  BENCH_WRITE_BATCH;
+
+    /* Hold the requested write rate, if any. */
+    if (opts->writeRate > 0.0) {
+      double ahead = writes / opts->writeRate - (benchNow() - start);
+      if (ahead > 0.0) usleep((useconds_t)(ahead * 1e6));
+    }
+  }
+
+  free(vec);
+  sqlite3_finalize(insertStmt);
+  sqlite3_finalize(deleteStmt);
+  sqlite3_close(db);
+  return NULL;
+}
+
+/*
+ * Drain every reader's latencies into one sorted array.
+ */
+static double* benchCollectLatencies(BenchConcurrentState* state, int* pN) {
+  int n = 0;
+  double* all = NULL;
+  for (int i = 0; i < state->opts->nReaders; i++) {
+    BenchLatencies* lat = &state->readerLat[i];
+    pthread_mutex_lock(&lat->lock);
+    all = realloc(all, (n + lat->n + 1) * sizeof(double));
+    memcpy(all + n, lat->samples, lat->n * sizeof(double));
+    n += lat->n;
+    lat->n = 0;
+    pthread_mutex_unlock(&lat->lock);
+  }
+  qsort(all, n, sizeof(double), benchCompareDouble);
+  *pN = n;
+  return all;
+}
+
+/*
+ * N reader connections running kNN queries while one writer replaces
+ * rows, reporting throughput and tail latency per interval.
+ */
+static int benchConcurrent(const BenchOptions* opts) {
+  sqlite3* db = benchCreateDb(opts);
+  if (!db) return 1;
+
+  BenchConcurrentState state = { .opts = opts };
+  state.readerLat = calloc(opts->nReaders, sizeof(BenchLatencies));
+  BenchReaderArg* readerArgs = calloc(opts->nReaders, sizeof(BenchReaderArg));
+  pthread_t* readers = calloc(opts->nReaders, sizeof(pthread_t));
+  pthread_t writer;
+
+  for (int i = 0; i < opts->nReaders; i++) {
+    pthread_mutex_init(&state.readerLat[i].lock, NULL);
+    readerArgs[i].state = &state;
+    readerArgs[i].id = i;
+    pthread_create(&readers[i], NULL, benchReaderThread, &readerArgs[i]);
+  }
+  pthread_create(&writer, NULL, benchWriterThread, &state);
+
+  printf("concurrent: %d readers, 1 writer, %d rows, dim %d, k %d\n",
+         opts->nReaders, opts->nRows, opts->dim, opts->k);
+  if (opts->writeRate > 0.0) {
+    printf("writer limited to %.0f rows/s\n", opts->writeRate);
+  }
+  printf("%8s %10s %10s %10s %10s %10s\n",
+         "time_s", "qps", "p50_ms", "p99_ms", "p999_ms", "writes/s");
+
+  double start = benchNow(), last = start;
+  long lastWrites = 0, totalQueries = 0;
+  while (last - start < opts->seconds) {
+    usleep((useconds_t)(opts->interval * 1e6));
+    double now = benchNow();
+    int n;
+    double* lat = benchCollectLatencies(&state, &n);
+    long writes = atomic_load(&state.nWrites);
+
+    printf("%8.1f %10.1f %10.3f %10.3f %10.3f %10.1f\n",
+           now - start, n / (now - last),
+           benchPercentile(lat, n, 0.50) * 1e3,
+           benchPercentile(lat, n, 0.99) * 1e3,
+           benchPercentile(lat, n, 0.999) * 1e3,
+           (writes - lastWrites) / (now - last));
+    fflush(stdout);
+
+    free(lat);
+    totalQueries += n;
+    lastWrites = writes;
+    last = now;
+  }
+
+  atomic_store(&state.stop, 1);
+  for (int i = 0; i < opts->nReaders; i++) {
+    pthread_join(readers[i], NULL);
+  }
+  pthread_join(writer, NULL);
+
+  double elapsed = benchNow() - start;
+  printf("total: %.1f qps, %.1f writes/s, %ld errors\n",
+         totalQueries / elapsed, atomic_load(&state.nWrites) / elapsed,
+         atomic_load(&state.nErrors));
+
+  for (int i = 0; i < opts->nReaders; i++) {
+    pthread_mutex_destroy(&state.readerLat[i].lock);
+    free(state.readerLat[i].samples);
+  }
+  free(state.readerLat);
+  free(readerArgs);
+  free(readers);
+  sqlite3_close(db);
+  return atomic_load(&state.nErrors) != 0;
+}
+
+/*
+ * Time each vector function over a full table scan, optionally with
+ * hardware counters, and report costs per vector.
+ */
+static int benchKernelsDim(const BenchOptions* opts, BenchCounters* ctrs) {
+  static const struct {
+    const char* zFName;
+    int nArg;
+  } kernelTbl[] = {
+    { "vector_dist",    2 },
+    { "vector_cosim",   2 },
+    { "vector_compare", 2 },
+    { "vector_add",     2 },
+    { "vector_mul",     2 },
+    { "vector_norm",    1 },
+    { "vector_avg",     1 },
+    { "vector_sum",     1 },
+    { "vector_max",     1 },
+    { "vector_argmax",  1 },
+  };
+
+  enum { nKernels = sizeof(kernelTbl) / sizeof(*kernelTbl) };
+
+  sqlite3* db = benchCreateDb(opts);
+  if (!db) return 1;
+
+  float* query = malloc(opts->dim * sizeof(float));
+  double* samples = malloc(nKernels * opts->runs * sizeof(double));
+  uint64_t seed = 0x8BB84B93962EACC9ULL;
+  benchDatasetVector(opts->zDataset, &seed, query, opts->dim);
+
+  printf("kernels: %d rows, dim %d, %s, %d runs\n", opts->nRows, opts->dim,
+         opts->zDataset, opts->runs);
+  printf("%-16s %10s %8s %10s %8s %12s %12s\n", "function", "ns/vec",
+         "mad", "cyc/vec", "ipc", "llcmiss/vec", "brmiss/vec");
+
+  int rc = 0;
+  sqlite3_stmt* stmts[nKernels];
+  for (int i = 0; i < nKernels; i++) {
+    char* zSql = sqlite3_mprintf("SELECT count(%s(v%s)) FROM vecs",
+                                 kernelTbl[i].zFName,
+                                 kernelTbl[i].nArg == 2 ? ", ?1" : "");
+    if (sqlite3_prepare_v2(db, zSql, -1, &stmts[i], NULL) != SQLITE_OK) {
+      fprintf(stderr, "%s: %s\n", zSql, sqlite3_errmsg(db));
+      stmts[i] = NULL;
+      rc = 1;
+    }
+    sqlite3_free(zSql);
+    if (!stmts[i]) continue;
+    sqlite3_bind_blob(stmts[i], 1, query, opts->dim * sizeof(float),
+                      SQLITE_STATIC);
+
+    /* Untimed pass so the table is in the page cache. */
+    while (sqlite3_step(stmts[i]) == SQLITE_ROW);
+    sqlite3_reset(stmts[i]);
+  }
+
+  /*
+   * Interleave the runs of every function, so a transient disturbance on
+   * the machine costs each function one slow run, which the median
+   * discards, rather than slowing every run of one function.
+   */
+  double n = opts->nRows;
+  uint64_t totals[nKernels][BENCH_CTR_COUNT];
+  int haveCounters[nKernels];
+  memset(totals, 0, sizeof(totals));
+  for (int i = 0; i < nKernels; i++) {
+    haveCounters[i] = ctrs->ok;
+  }
+  for (int run = 0; run < opts->runs; run++) {
+    for (int i = 0; i < nKernels; i++) {
+      if (!stmts[i]) continue;
+      uint64_t values[BENCH_CTR_COUNT];
+      benchCountersStart(ctrs);
+      double start = benchNow();
+      while (sqlite3_step(stmts[i]) == SQLITE_ROW);
+      samples[i * opts->runs + run] = (benchNow() - start) / n * 1e9;
+      if (benchCountersStop(ctrs, values)) {
+        for (int c = 0; c < BENCH_CTR_COUNT; c++) {
+          totals[i][c] += values[c];
+        }
+      } else {
+        haveCounters[i] = 0;
+      }
+      sqlite3_reset(stmts[i]);
+    }
+  }
+
+  n *= opts->runs;
+  for (int i = 0; i < nKernels; i++) {
+    if (!stmts[i]) continue;
+    sqlite3_finalize(stmts[i]);
+
+    BenchResult* res = benchRecord(kernelTbl[i].zFName, opts->zDataset,
+                                   opts->dim, samples + i * opts->runs,
+                                   opts->runs);
+    printf("%-16s %10.1f %8.1f", res->zName, res->median, res->mad);
+    if (haveCounters[i]) {
+      printf(" %10.1f %8.2f %12.3f %12.3f\n",
+             totals[i][BENCH_CTR_CYCLES] / n,
+             totals[i][BENCH_CTR_CYCLES]
+               ? (double)totals[i][BENCH_CTR_INSTRUCTIONS]
+                 / totals[i][BENCH_CTR_CYCLES]
+               : 0.0,
+             totals[i][BENCH_CTR_CACHE_MISSES] / n,
+             totals[i][BENCH_CTR_BRANCH_MISSES] / n);
+    } else {
+      printf(" %10s %8s %12s %12s\n", "-", "-", "-", "-");
+    }
+  }
+
+  free(samples);
+  free(query);
+  sqlite3_close(db);
+  return rc;
+}
+
+static int benchKernels(const BenchOptions* opts) {
+  BenchCounters ctrs = { .ok = 0 };
+  if (opts->useCounters && !benchCountersOpen(&ctrs)) {
+    fprintf(stderr, "kernels: hardware counters unavailable\n");
+  }
+
+  int rc = 0;
+  for (int d = 0; d < opts->nDims; d++) {
+    BenchOptions dimOpts = *opts;
+    dimOpts.dim = opts->dims[d];
+    rc |= benchKernelsDim(&dimOpts, &ctrs);
+  }
+
+  if (ctrs.ok) benchCountersClose(&ctrs);
+  return rc;
+}
+
+/*
+ * Time parsing of one large vector per dimension from each text format,
+ * reporting the cost per element.
+ */
+static int benchParse(const BenchOptions* opts) {
+  static const struct {
+    const char* zName;
+    const char* zFormat;
+    const char* zToText;
+  } formatTbl[] = {
+    { "parse_json",   "json",   "vector_to_json(?1)" },
+    { "parse_csv",    "csv",    "trim(vector_to_json(?1), '[]')" },
+    { "parse_base64", "base64", "vector_to_base64(?1)" },
+  };
+
+  sqlite3* db = benchOpen(":memory:",
+                          SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE);
+  if (!db) return 1;
+
+  double* samples = malloc(opts->runs * sizeof(double));
+  int rc = 0;
+  for (int d = 0; d < opts->nDims; d++) {
+    int dim = opts->dims[d];
+    float* vec = malloc(dim * sizeof(float));
+    uint64_t seed = 0x94D049BB133111EBULL;
+    benchDatasetVector(opts->zDataset, &seed, vec, dim);
+
+    printf("parse: dim %d, %s, %d runs\n", dim, opts->zDataset, opts->runs);
+    printf("%-16s %12s %10s %10s\n", "format", "text_bytes", "ns/elem",
+           "mad");
+
+    for (int i = 0; i < sizeof(formatTbl) / sizeof(*formatTbl); i++) {
+      char* zSql = sqlite3_mprintf("SELECT %s", formatTbl[i].zToText);
+      sqlite3_stmt *textStmt, *parseStmt;
+      sqlite3_prepare_v2(db, zSql, -1, &textStmt, NULL);
+      sqlite3_free(zSql);
+      sqlite3_bind_blob(textStmt, 1, vec, dim * sizeof(float),
+                        SQLITE_STATIC);
+      if (sqlite3_step(textStmt) != SQLITE_ROW ||
+          sqlite3_prepare_v2(db, "SELECT length(vector_from_text(?1, ?2))",
+                             -1, &parseStmt, NULL) != SQLITE_OK) {
+        fprintf(stderr, "parse: %s\n", sqlite3_errmsg(db));
+        sqlite3_finalize(textStmt);
+        rc = 1;
+        continue;
+      }
+      int textLen = sqlite3_column_bytes(textStmt, 0);
+      sqlite3_bind_text(parseStmt, 1,
+                        (const char*)sqlite3_column_text(textStmt, 0),
+                        textLen, SQLITE_STATIC);
+      sqlite3_bind_text(parseStmt, 2, formatTbl[i].zFormat, -1,
+                        SQLITE_STATIC);
+
+      for (int run = 0; run < opts->runs; run++) {
+        double start = benchNow();
+        if (sqlite3_step(parseStmt) != SQLITE_ROW ||
+            sqlite3_column_int(parseStmt, 0) != dim * sizeof(float)) {
+          fprintf(stderr, "parse: %s failed\n", formatTbl[i].zFormat);
+          rc = 1;
+        }
+        samples[run] = (benchNow() - start) / dim * 1e9;
+        sqlite3_reset(parseStmt);
+      }
+      sqlite3_finalize(parseStmt);
+      sqlite3_finalize(textStmt);
+
+      BenchResult* res = benchRecord(formatTbl[i].zName, opts->zDataset,
+                                     dim, samples, opts->runs);
+      printf("%-16s %12d %10.2f %10.2f\n", res->zName, textLen,
+             res->median, res->mad);
+    }
+    free(vec);
+  }
+
+  free(samples);
+  sqlite3_close(db);
+  return rc;
+}
+
+/*
+ * Write recorded results as JSON, one object per line.
+ */
+static int benchWriteJson(const char* zPath, const char* zScenario) {
+  FILE* out = strcmp(zPath, "-") == 0 ? stdout : fopen(zPath, "w");
+  if (!out) {
+    perror(zPath);
+    return 1;
+  }
+
+  for (int i = 0; i < benchResultCount; i++) {
+    const BenchResult* res = &benchResults[i];
+    fprintf(out, "{\"scenario\":\"%s\",\"name\":\"%s\",\"dim\":%d,"
+                 "\"dataset\":\"%s\",\"runs\":%d,"
+                 "\"median_ns\":%.3f,\"mad_ns\":%.3f}\n",
+            zScenario, res->zName, res->dim, res->zDataset, res->runs,
+            res->median, res->mad);
+  }
+
+  if (out != stdout) fclose(out);
+  return 0;
+}
+
+/*
+ * Find the value of a key in one line of our own JSON output.
+ */
+static const char* benchJsonField(const char* zLine, const char* zKey) {
+  char zPattern[64];
+  snprintf(zPattern, sizeof(zPattern), "\"%s\":", zKey);
+  const char* p = strstr(zLine, zPattern);
+  return p ? p + strlen(zPattern) : NULL;
+}
+
+static int benchJsonString(const char* zLine, const char* zKey,
+                           char* zBuf, int nBuf) {
+  const char* p = benchJsonField(zLine, zKey);
+  if (!p || *p != '"') return 0;
+  const char* end = strchr(++p, '"');
+  if (!end || end - p >= nBuf) return 0;
+  memcpy(zBuf, p, end - p);
+  zBuf[end - p] = '\0';
+  return 1;
+}
+
+static int benchJsonNumber(const char* zLine, const char* zKey,
+                           double* pValue) {
+  const char* p = benchJsonField(zLine, zKey);
+  char* end;
+  if (!p) return 0;
+  *pValue = strtod(p, &end);
+  return end != p;
+}
+
+/*
+ * Compare recorded results against a baseline file written by -j.
+ *
+ * Timings move by more between invocations (code layout, frequency
+ * scaling, neighbours on the machine) than between runs inside one, so
+ * the noise estimate has to come from separate invocations. A baseline is
+ * therefore several -j files concatenated, and each result needs at least
+ * BENCH_MIN_BASELINE_RUNS of them. A result regresses when its median is
+ * slower than the median of the baseline invocations by the relative
+ * threshold, by three robust standard deviations of their spread, and by
+ * their full range.
+ * Returns 1 if anything regressed or the baseline has too few runs.
+ */
+static int benchCompareBaseline(const char* zPath, double threshold) {
+  FILE* in = fopen(zPath, "r");
+  if (!in) {
+    perror(zPath);
+    return 1;
+  }
+
+  BenchResult* base = NULL;
+  int nBase = 0;
+  char zLine[512];
+  while (fgets(zLine, sizeof(zLine), in)) {
+    BenchResult res;
+    double dim;
+    if (!benchJsonString(zLine, "name", res.zName, sizeof(res.zName)) ||
+        !benchJsonString(zLine, "dataset", res.zDataset,
+                         sizeof(res.zDataset)) ||
+        !benchJsonNumber(zLine, "dim", &dim) ||
+        !benchJsonNumber(zLine, "median_ns", &res.median) ||
+        !benchJsonNumber(zLine, "mad_ns", &res.mad)) {
+      continue;
+    }
+    res.dim = (int)dim;
+    base = realloc(base, (nBase + 1) * sizeof(BenchResult));
+    base[nBase++] = res;
+  }
+  fclose(in);
+
+  printf("baseline %s, threshold %.1f%%\n", zPath, threshold * 100.0);
+  printf("%-16s %6s %-10s %4s %10s %10s %8s %8s  %s\n", "name", "dim",
+         "dataset", "runs", "base_ns", "ns", "change", "noise", "status");
+
+  int regressed = 0, tooFew = 0;
+  double* medians = malloc((nBase + 1) * sizeof(double));
+  for (int i = 0; i < benchResultCount; i++) {
+    const BenchResult* cur = &benchResults[i];
+    int n = 0;
+    for (int j = 0; j < nBase; j++) {
+      if (base[j].dim == cur->dim && strcmp(base[j].zName, cur->zName) == 0 &&
+          strcmp(base[j].zDataset, cur->zDataset) == 0) {
+        medians[n++] = base[j].median;
+      }
+    }
+
+    if (n == 0) {
+      printf("%-16s %6d %-10s %4d %10s %10.1f %8s %8s  new\n", cur->zName,
+             cur->dim, cur->zDataset, 0, "-", cur->median, "-", "-");
+      continue;
+    }
+
+    double baseMedian = benchMedian(medians, n);
+    double pct = baseMedian > 0.0 ? 100.0 / baseMedian : 0.0;
+    if (n < BENCH_MIN_BASELINE_RUNS) {
+      printf("%-16s %6d %-10s %4d %10.1f %10.1f %+7.1f%% %8s  too few runs\n",
+             cur->zName, cur->dim, cur->zDataset, n, baseMedian,
+             cur->median, (cur->median - baseMedian) * pct, "-");
+      tooFew = 1;
+      continue;
+    }
+
+    /* medians[] is sorted; a MAD from few runs can be implausibly small,
+     * so the noise band is never narrower than their observed range. */
+    double range = medians[n - 1] - medians[0];
+    for (int j = 0; j < n; j++) {
+      medians[j] = fabs(medians[j] - baseMedian);
+    }
+    double spread = BENCH_MAD_SIGMA * fmax(benchMedian(medians, n),
+                                           cur->mad);
+    double limit = fmax(fmax(3.0 * spread, range), threshold * baseMedian);
+    double delta = cur->median - baseMedian;
+    const char* zStatus = "ok";
+    if (delta > limit) {
+      zStatus = "REGRESSION";
+      regressed = 1;
+    } else if (-delta > limit) {
+      zStatus = "improved";
+    }
+
+    printf("%-16s %6d %-10s %4d %10.1f %10.1f %+7.1f%% %7.1f%%  %s\n",
+           cur->zName, cur->dim, cur->zDataset, n, baseMedian, cur->median,
+           delta * pct, limit * pct, zStatus);
+  }
+  free(medians);
+  free(base);
+
+  if (tooFew) {
+    fprintf(stderr, "baseline %s: need results from at least %d separate "
+                    "invocations; concatenate several -j files\n",
+            zPath, BENCH_MIN_BASELINE_RUNS);
+  }
+  return regressed || tooFew;
+}
+
+static const struct {
+  const char* zName;
+  const char* zHelp;
+  int (*xRun)(const BenchOptions*);
+} scenarioTbl[] = {
+  { "concurrent", "N readers running kNN queries against one writer",
+                  benchConcurrent },
+  { "kernels",    "per-vector cost of each vector function",
+                  benchKernels },
+  { "parse",      "per-element cost of parsing text formats",
+                  benchParse },
+};
+
+static void benchUsage(const char* zArgv0) {
+  fprintf(stderr,
+          "usage: %s [options] scenario\n"
+          "  -f path     database file (default: vecdex_bench.db)\n"
+          "  -n rows     initial number of vectors (default: 10000)\n"
+          "  -d dims     vector dimensions, comma-separated (default: 128)\n"
+          "  -D dataset  uniform or gaussian (default: uniform)\n"
+          "  -k k        neighbours per query (default: 10)\n"
+          "  -r readers  reader connections (default: 4)\n"
+          "  -w rate     writer rows per second, 0 for no limit "
+          "(default: 0)\n"
+          "  -t seconds  run time (default: 10)\n"
+          "  -i seconds  report interval (default: 1)\n"
+          "  -p          read hardware performance counters\n"
+          "  -R runs     repeated runs per measurement (default: 5)\n"
+          "  -j path     write results as JSON lines ('-' for stdout)\n"
+          "  -b path     compare results against a baseline: several -j files\n"
+          "              from separate invocations, concatenated\n"
+          "  -T percent  regression threshold (default: 5)\n"
+          "scenarios:\n", zArgv0);
+  for (int i = 0; i < sizeof(scenarioTbl) / sizeof(*scenarioTbl); i++) {
+    fprintf(stderr, "  %-12s%s\n", scenarioTbl[i].zName,
+            scenarioTbl[i].zHelp);
+  }
+}
+
+int main(int argc, char** argv) {
+  BenchOptions opts = {
+    .zDbPath = "vecdex_bench.db",
+    .zDataset = "uniform",
+    .nRows = 10000,
+    .dims = { 128 },
+    .nDims = 1,
+    .k = 10,
+    .nReaders = 4,
+    .seconds = 10.0,
+    .interval = 1.0,
+    .runs = 5,
+    .threshold = 0.05,
+  };
+
+  int opt;
+  while ((opt = getopt(argc, argv, "f:n:d:D:k:r:w:t:i:pR:j:b:T:")) != -1) {
+    switch (opt) {
+      case 'f': opts.zDbPath = optarg; break;
+      case 'n': opts.nRows = atoi(optarg); break;
+      case 'd': {
+        opts.nDims = 0;
+        for (char* z = strtok(optarg, ","); z && opts.nDims < BENCH_MAX_DIMS;
+             z = strtok(NULL, ",")) {
+          opts.dims[opts.nDims++] = atoi(z);
+        }
+        break;
+      }
+      case 'D': opts.zDataset = optarg; break;
+      case 'k': opts.k = atoi(optarg); break;
+      case 'r': opts.nReaders = atoi(optarg); break;
+      case 'w': opts.writeRate = atof(optarg); break;
+      case 't': opts.seconds = atof(optarg); break;
+      case 'i': opts.interval = atof(optarg); break;
+      case 'p': opts.useCounters = 1; break;
+      case 'R': opts.runs = atoi(optarg); break;
+      case 'j': opts.zJsonPath = optarg; break;
+      case 'b': opts.zBaselinePath = optarg; break;
+      case 'T': opts.threshold = atof(optarg) / 100.0; break;
+      default:
+        benchUsage(argv[0]);
+        return 2;
+    }
+  }
+
+  int validDims = opts.nDims > 0;
+  for (int i = 0; i < opts.nDims; i++) {
+    validDims &= opts.dims[i] > 0;
+  }
+  opts.dim = opts.dims[0];
+
+  if (optind != argc - 1 || opts.nRows < 1 || !validDims || opts.k < 1 ||
+      opts.nReaders < 1 || opts.writeRate < 0.0 || opts.interval <= 0.0 ||
+      opts.runs < 1 ||
+      (strcmp(opts.zDataset, "uniform") != 0 &&
+       strcmp(opts.zDataset, "gaussian") != 0)) {
+    benchUsage(argv[0]);
+    return 2;
+  }
+
+  for (int i = 0; i < sizeof(scenarioTbl) / sizeof(*scenarioTbl); i++) {
+    if (strcmp(argv[optind], scenarioTbl[i].zName) == 0) {
+      int rc = scenarioTbl[i].xRun(&opts);
+      /* Compare first, so -j may overwrite the file given to -b. */
+      if (opts.zBaselinePath) {
+        rc |= benchCompareBaseline(opts.zBaselinePath, opts.threshold);
+      }
+      if (opts.zJsonPath) {
+        rc |= benchWriteJson(opts.zJsonPath, scenarioTbl[i].zName);
+      }
+      free(benchResults);
+      return rc;
+    }
+  }
+
+  benchUsage(argv[0]);
+  return 2;
+}